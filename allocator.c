@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "allocator.h"
+#include "utils.h"
+
+
+#define ARENA_ALIGN 16
+
+typedef struct _arena_chunk {
+    struct _arena_chunk* next;
+    size_t capacity;
+    size_t used;
+    _Alignas(ARENA_ALIGN) uint8_t data[];
+} arena_chunk_t;
+
+struct _huffman_arena {
+    arena_chunk_t* head;
+    arena_chunk_t* current;
+    uint8_t* last;
+    size_t chunk_size;
+};
+
+
+void* huffman_alloc(const huffman_allocator_t* allocator, size_t size) {
+    void* ptr = (allocator == NULL) ? malloc(size) : allocator->alloc(allocator->ctx, size);
+    if (ptr == NULL && size > 0) utils_fatal_error("huffman_alloc() failed");
+    return ptr;
+}
+
+void* huffman_realloc(const huffman_allocator_t* allocator, void* ptr, size_t old_size, size_t new_size) {
+    void* new_ptr;
+    if (allocator == NULL) new_ptr = realloc(ptr, new_size);
+    else                   new_ptr = allocator->realloc(allocator->ctx, ptr, old_size, new_size);
+    if (new_ptr == NULL && new_size > 0) utils_fatal_error("huffman_realloc() failed");
+    return new_ptr;
+}
+
+void huffman_free(const huffman_allocator_t* allocator, void* ptr) {
+    if (ptr == NULL) return;
+    if (allocator == NULL) free(ptr);
+    else                   allocator->free(allocator->ctx, ptr);
+}
+
+char* huffman_strdup(const huffman_allocator_t* allocator, const char* str) {
+    size_t size = strlen(str) + 1;
+    char* dup = huffman_alloc(allocator, size);
+    memcpy(dup, str, size);
+    return dup;
+}
+
+static arena_chunk_t* arena_chunk_create(size_t capacity) {
+    arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + capacity);
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void* arena_alloc(void* ctx, size_t size) {
+    huffman_arena_t* arena = ctx;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_chunk_t* chunk = arena->current;
+    while (chunk->used + size > chunk->capacity) {
+        arena_chunk_t* next = chunk->next;
+        if (next == NULL || next->capacity < size) {
+            size_t capacity = size > arena->chunk_size ? size : arena->chunk_size;
+            arena_chunk_t* fresh = arena_chunk_create(capacity);
+            if (fresh == NULL) return NULL;
+            fresh->next = next;
+            chunk->next = fresh;
+            next = fresh;
+        }
+        next->used = 0;
+        chunk = next;
+    }
+    arena->current = chunk;
+    arena->last = chunk->data + chunk->used;
+    chunk->used += size;
+    return arena->last;
+}
+
+static void* arena_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+    huffman_arena_t* arena = ctx;
+    if (ptr == NULL) return arena_alloc(ctx, new_size);
+    arena_chunk_t* chunk = arena->current;
+    if (ptr == arena->last) {
+        size_t offset = arena->last - chunk->data;
+        size_t size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + size <= chunk->capacity) {
+            chunk->used = offset + size;
+            return ptr;
+        }
+    }
+    void* new_ptr = arena_alloc(ctx, new_size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+static void arena_free(void* ctx, void* ptr) {
+    (void)ctx;
+    (void)ptr;
+}
+
+huffman_arena_t* huffman_arena_create(size_t chunk_size) {
+    huffman_arena_t* arena = malloc(sizeof(huffman_arena_t));
+    if (arena == NULL) utils_fatal_error("huffman_arena_create() failed");
+    arena->chunk_size = chunk_size;
+    arena->head = arena_chunk_create(chunk_size);
+    if (arena->head == NULL) utils_fatal_error("huffman_arena_create() failed");
+    arena->current = arena->head;
+    arena->last = NULL;
+    return arena;
+}
+
+huffman_allocator_t huffman_arena_allocator(huffman_arena_t* arena) {
+    huffman_allocator_t allocator;
+    allocator.alloc = arena_alloc;
+    allocator.realloc = arena_realloc;
+    allocator.free = arena_free;
+    allocator.ctx = arena;
+    return allocator;
+}
+
+void huffman_arena_reset(huffman_arena_t* arena) {
+    arena->current = arena->head;
+    arena->head->used = 0;
+    arena->last = NULL;
+}
+
+void huffman_arena_trim(huffman_arena_t* arena, size_t keep) {
+    huffman_arena_reset(arena);
+    arena_chunk_t* chunk = arena->head;
+    size_t kept = chunk->capacity;
+    while (chunk->next != NULL && kept + chunk->next->capacity <= keep) {
+        chunk = chunk->next;
+        kept += chunk->capacity;
+    }
+    arena_chunk_t* extra = chunk->next;
+    chunk->next = NULL;
+    while (extra != NULL) {
+        arena_chunk_t* next = extra->next;
+        free(extra);
+        extra = next;
+    }
+}
+
+void huffman_arena_destroy(huffman_arena_t* arena) {
+    arena_chunk_t* chunk = arena->head;
+    while (chunk != NULL) {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
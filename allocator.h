@@ -0,0 +1,31 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+    void  (*free)(void* ctx, void* ptr);
+    void* ctx;
+} huffman_allocator_t;
+
+typedef struct _huffman_arena huffman_arena_t;
+
+// A NULL allocator means malloc/realloc/free. Failures are fatal.
+void* huffman_alloc(const huffman_allocator_t* allocator, size_t size);
+void* huffman_realloc(const huffman_allocator_t* allocator, void* ptr, size_t old_size, size_t new_size);
+void huffman_free(const huffman_allocator_t* allocator, void* ptr);
+char* huffman_strdup(const huffman_allocator_t* allocator, const char* str);
+
+// Bump allocator: free is a no-op and reset releases everything in O(1).
+huffman_arena_t* huffman_arena_create(size_t chunk_size);
+huffman_allocator_t huffman_arena_allocator(huffman_arena_t* arena);
+void huffman_arena_reset(huffman_arena_t* arena);
+// Resets and frees the chunks past the first keep bytes.
+void huffman_arena_trim(huffman_arena_t* arena, size_t keep);
+void huffman_arena_destroy(huffman_arena_t* arena);
+
+#endif
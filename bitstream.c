@@ -9,41 +9,41 @@
 
 
 static void bits_adjust_size(bits_t* bs, size_t size) {
-    bs->data = realloc(bs->data, size);
-    if (bs->data == NULL) utils_fatal_error("bits_adjust() failed");
+    bs->data = huffman_realloc(bs->allocator, bs->data, bs->size_in_bytes, size);
+    // zero the new tail so padding bits don't depend on what the allocator recycled
+    if (size > bs->size_in_bytes)
+        memset(bs->data + bs->size_in_bytes, 0, size - bs->size_in_bytes);
     bs->size_in_bytes = size;
 }
 
 static void bits_ensure_size(bits_t* bs, size_t bit_index) {
     size_t byte_index = bit_index / 8;
-    size_t bit_offset = bit_index % 8;
     if (bs->data == NULL || bit_index >= bs->size_in_bytes * 8) {
-        bs->size_in_bytes = (byte_index + 1) * 2;
-        bits_adjust_size(bs, bs->size_in_bytes);
+        bits_adjust_size(bs, (byte_index + 1) * 2);
     }
 }
 
-bits_t* bits_create() {
-    bits_t* bs = malloc(sizeof(bits_t));
-    if (bs == NULL) utils_fatal_error("bits_create() failed");
+bits_t* bits_create(const huffman_allocator_t* allocator) {
+    bits_t* bs = huffman_alloc(allocator, sizeof(bits_t));
     bs->data = NULL;
     bs->size_in_bytes = 0;
+    bs->allocator = allocator;
     return bs;
 }
 
-bits_t* bits_create_from_data(uint8_t* data, size_t size) {
-    bits_t* bs = malloc(sizeof(bits_t));
-    if (bs == NULL) utils_fatal_error("bits_create_from_data() failed");
+bits_t* bits_create_from_data(uint8_t* data, size_t size, const huffman_allocator_t* allocator) {
+    bits_t* bs = huffman_alloc(allocator, sizeof(bits_t));
     bs->data = data;
     bs->size_in_bytes = size;
+    bs->allocator = allocator;
     return bs;
 }
 
 void bits_destroy(bits_t* bs) {
     bs->size_in_bytes = 0;
-    free(bs->data);
+    huffman_free(bs->allocator, bs->data);
     bs->data = NULL;
-    free(bs);
+    huffman_free(bs->allocator, bs);
 }
 
 void bits_trunc(bits_t* bs, size_t size) {
@@ -56,6 +56,12 @@ void bits_trunc_to_bit_index(bits_t* bs, size_t bit_index) {
     bits_trunc(bs, new_size_in_bytes);
 }
 
+void bits_extend_to_bit_index(bits_t* bs, size_t bit_index) {
+    size_t new_size_in_bytes = (bit_index + 7) / 8;
+    if (new_size_in_bytes > bs->size_in_bytes)
+        bits_adjust_size(bs, new_size_in_bytes);
+}
+
 void bits_set_at(bits_t* bs, size_t bit_index) {
     if (bs == NULL) return;
     bits_ensure_size(bs, bit_index);
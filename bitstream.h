@@ -3,18 +3,21 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "allocator.h"
 
 typedef struct {
     uint8_t* data;
     size_t size_in_bytes;
+    const huffman_allocator_t* allocator;
 } bits_t;
 
 
-bits_t* bits_create();
-bits_t* bits_create_from_data(uint8_t* data, size_t size);
+bits_t* bits_create(const huffman_allocator_t* allocator);
+bits_t* bits_create_from_data(uint8_t* data, size_t size, const huffman_allocator_t* allocator);
 void bits_destroy(bits_t* bs);
 void bits_trunc(bits_t* bs, size_t size);
 void bits_trunc_to_bit_index(bits_t* bs, size_t bit_index);
+void bits_extend_to_bit_index(bits_t* bs, size_t bit_index);
 void bits_set_at(bits_t* bs, size_t bit_index);
 void bits_clear_at(bits_t* bs, size_t bit_index);
 bool bits_read_bit_at(bits_t* bs, size_t bit_index);
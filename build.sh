@@ -1,3 +1,3 @@
 #!/bin/bash
 
-gcc -o huffman main.c huffman.c bitstream.c utils.c -g
+gcc -o huffman main.c huffman.c bitstream.c utils.c server.c allocator.c -g -pthread
@@ -4,18 +4,51 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "huffman.h"
 #include "bitstream.h"
 #include "utils.h"
 
 
+#define HUFFMAN_MAX_THREADS     64
+#define HUFFMAN_MIN_SLICE_SIZE  (64 * 1024)
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    uint32_t hist[256];
+    char** codes;
+    size_t start_bit;
+    uint8_t* out;
+    bool has_head;
+    size_t head_index;
+    uint8_t head;
+    bool has_tail;
+    size_t tail_index;
+    uint8_t tail;
+} huffman_slice_t;
+
+typedef struct {
+    huffman_header_t header;
+    uint8_t* data;
+    huffman_node_t** nodes_array;
+    huffman_node_t* root;
+    size_t bit_index;
+    size_t end_bit;
+} huffman_segment_t;
+
+static bool huffman_verbose = true;
+
+void huffman_set_verbose(bool verbose) {
+    huffman_verbose = verbose;
+}
+
 static bool is_leaf(huffman_node_t * node) {
     return (node->left == NULL && node->right == NULL);
 }
 
-static huffman_node_t* huffman_create_node_for_byte(uint8_t byte, uint32_t freq) {
-    huffman_node_t* node = malloc(sizeof(huffman_node_t));
-    if (node == NULL) utils_fatal_error("huffman_create_node_for_byte() failed");
+static huffman_node_t* huffman_create_node_for_byte(uint8_t byte, uint32_t freq, const huffman_allocator_t* allocator) {
+    huffman_node_t* node = huffman_alloc(allocator, sizeof(huffman_node_t));
     node->byte = byte;
     node->freq = freq;
     node->code = NULL;
@@ -24,8 +57,8 @@ static huffman_node_t* huffman_create_node_for_byte(uint8_t byte, uint32_t freq)
     return node;
 }
 
-static huffman_node_t* huffman_join_nodes(huffman_node_t* a, huffman_node_t* b) {
-    huffman_node_t* node = huffman_create_node_for_byte(0, a->freq + b->freq);
+static huffman_node_t* huffman_join_nodes(huffman_node_t* a, huffman_node_t* b, const huffman_allocator_t* allocator) {
+    huffman_node_t* node = huffman_create_node_for_byte(0, a->freq + b->freq, allocator);
     if (a->freq <= b->freq) {
         node->left = a;
         node->right = b;
@@ -46,11 +79,11 @@ static uint32_t huffman_histogram(uint32_t* hist, uint8_t* data, size_t size) {
     return nodes_count;
 }
 
-static void huffman_create_nodes(huffman_node_t** nodes_array, uint32_t* hist) {
+static void huffman_create_nodes(huffman_node_t** nodes_array, uint32_t* hist, const huffman_allocator_t* allocator) {
     uint32_t index = 0;
     for (uint32_t i = 0; i < 256; i++) {
         if (hist[i] == 0) continue;
-        nodes_array[index++] = huffman_create_node_for_byte(i, hist[i]);
+        nodes_array[index++] = huffman_create_node_for_byte(i, hist[i], allocator);
     }
 }
 
@@ -68,10 +101,8 @@ static void huffman_sort_nodes(huffman_node_t** nodes_array, uint32_t nodes_coun
     qsort(nodes_array, nodes_count, sizeof(huffman_node_t *), huffman_cmp_freq);
 }
 
-static huffman_node_t** huffman_alloc_nodes_array(uint32_t nodes_count) {
-    huffman_node_t** nodes_array = malloc(nodes_count * sizeof(huffman_node_t *));
-    if (nodes_array == NULL) utils_fatal_error("huffman_compress() failed");
-    return nodes_array;
+static huffman_node_t** huffman_alloc_nodes_array(uint32_t nodes_count, const huffman_allocator_t* allocator) {
+    return huffman_alloc(allocator, nodes_count * sizeof(huffman_node_t *));
 }
 
 static huffman_node_t* huffman_pop_node(huffman_node_t*** nodes_array) {
@@ -85,13 +116,13 @@ static void huffman_push_node(huffman_node_t*** nodes_array, huffman_node_t* nod
     **nodes_array = node;
 }
 
-static huffman_node_t* huffman_build_tree(huffman_node_t** nodes_array, uint32_t nodes_count) {
+static huffman_node_t* huffman_build_tree(huffman_node_t** nodes_array, uint32_t nodes_count, const huffman_allocator_t* allocator) {
     huffman_node_t** stack = nodes_array;
     while (nodes_count > 1) {
         huffman_sort_nodes(stack, nodes_count);
         huffman_node_t* node1 = huffman_pop_node(&stack);
         huffman_node_t* node2 = huffman_pop_node(&stack);
-        huffman_node_t* new_node = huffman_join_nodes(node1, node2);
+        huffman_node_t* new_node = huffman_join_nodes(node1, node2, allocator);
         huffman_push_node(&stack, new_node);
         nodes_count--;
     }
@@ -110,38 +141,38 @@ static void huffman_show_tree(huffman_node_t* root, uint32_t level) {
     huffman_show_tree(root->right, level+1);
 }
 
-static void huffman_destroy_tree(huffman_node_t* root) {
+static void huffman_destroy_tree(huffman_node_t* root, const huffman_allocator_t* allocator) {
     if (root == NULL) return;
-    huffman_destroy_tree(root->left);
-    huffman_destroy_tree(root->right);
-    free(root->code);
+    huffman_destroy_tree(root->left, allocator);
+    huffman_destroy_tree(root->right, allocator);
+    huffman_free(allocator, root->code);
     root->code = NULL;
-    free(root);
+    huffman_free(allocator, root);
 }
 
-static void do_construct_code(huffman_node_t* root, char* path, char** codes, size_t size) {
+static void do_construct_code(huffman_node_t* root, char* path, char** codes, size_t size, const huffman_allocator_t* allocator) {
     if (root == NULL) return;
     if (is_leaf(root)) {
         if (path[0] == 0) {
-            root->code = strdup("0");
+            root->code = huffman_strdup(allocator, "0");
             codes[root->byte] = root->code;
             return;
         }
         path[size] = 0;
-        root->code = strdup(path);
+        root->code = huffman_strdup(allocator, path);
         codes[root->byte] = root->code;
     }
     path[size] = '0';
-    do_construct_code(root->left, path, codes, size+1);
+    do_construct_code(root->left, path, codes, size+1, allocator);
     path[size] = '1';
-    do_construct_code(root->right, path, codes, size+1);
+    do_construct_code(root->right, path, codes, size+1, allocator);
 }
 
-static void huffman_construct_code(huffman_node_t* root, char** codes) {
+static void huffman_construct_code(huffman_node_t* root, char** codes, const huffman_allocator_t* allocator) {
     char path[256];
     memset(path, 0, sizeof(path));
     memset(codes, 0, 256*sizeof(char *));
-    do_construct_code(root, path, codes, 0);
+    do_construct_code(root, path, codes, 0, allocator);
 }
 
 static void huffman_encode_data(huffman_header_t* header, uint8_t* data, char** codes) {
@@ -262,35 +293,163 @@ static void huffman_print_header_info(huffman_header_t* header) {
 }
 
 huffman_cdata_t* huffman_compress(uint8_t* data, size_t size) {
+    return huffman_compress_with_allocator(data, size, NULL);
+}
+
+huffman_cdata_t* huffman_compress_with_allocator(uint8_t* data, size_t size, const huffman_allocator_t* allocator) {
+    return huffman_compress_parallel(data, size, 1, allocator);
+}
+
+static void* huffman_slice_histogram(void* arg) {
+    huffman_slice_t* slice = arg;
+    huffman_histogram(slice->hist, slice->data, slice->size);
+    return NULL;
+}
+
+// Bytes this slice fully owns are stored directly. Its first byte, when
+// shared with the previous slice (or the header), and its last partial
+// byte are kept aside and OR'ed in by huffman_stitch_slices().
+static void* huffman_slice_encode(void* arg) {
+    huffman_slice_t* slice = arg;
+    size_t byte_index = slice->start_bit / 8;
+    uint32_t fill = slice->start_bit % 8;
+    bool shared_head = (fill != 0);
+    uint8_t acc = 0;
+    for (size_t i = 0; i < slice->size; i++) {
+        for (const char* code = slice->codes[slice->data[i]]; *code; code++) {
+            acc = (acc << 1) | (*code == '1');
+            if (++fill < 8) continue;
+            if (shared_head) {
+                slice->head = acc;
+                slice->head_index = byte_index;
+                slice->has_head = true;
+                shared_head = false;
+            }
+            else {
+                slice->out[byte_index] = acc;
+            }
+            byte_index++;
+            fill = 0;
+            acc = 0;
+        }
+    }
+    if (fill > 0) {
+        slice->tail = acc << (8 - fill);
+        slice->tail_index = byte_index;
+        slice->has_tail = true;
+    }
+    return NULL;
+}
+
+static void huffman_run_slices(huffman_slice_t* slices, uint32_t count, void* (*fn)(void*)) {
+    pthread_t threads[HUFFMAN_MAX_THREADS];
+    for (uint32_t i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, fn, &slices[i]) != 0)
+            utils_fatal_error("huffman_run_slices() failed");
+    }
+    fn(&slices[0]);
+    for (uint32_t i = 1; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void huffman_stitch_slices(bits_t* bs, huffman_slice_t* slices, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (slices[i].has_head) bs->data[slices[i].head_index] |= slices[i].head;
+        if (slices[i].has_tail) bs->data[slices[i].tail_index] |= slices[i].tail;
+    }
+}
+
+static void huffman_encode_data_parallel(huffman_header_t* header, huffman_slice_t* slices, uint32_t count, char** codes) {
+    size_t code_len[256];
+    for (uint32_t i = 0; i < 256; i++)
+        code_len[i] = (codes[i] != NULL) ? strlen(codes[i]) : 0;
+    // prefix sum of the encoded slice lengths gives each slice its start bit
+    size_t bit_index = header->bit_index;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t bits = 0;
+        for (uint32_t j = 0; j < 256; j++)
+            bits += (size_t)slices[i].hist[j] * code_len[j];
+        slices[i].start_bit = bit_index;
+        slices[i].codes = codes;
+        bit_index += bits;
+    }
+    bits_extend_to_bit_index(header->bs, bit_index);
+    for (uint32_t i = 0; i < count; i++)
+        slices[i].out = header->bs->data;
+    huffman_run_slices(slices, count, huffman_slice_encode);
+    huffman_stitch_slices(header->bs, slices, count);
+    header->bit_index = bit_index;
+}
+
+static uint32_t huffman_count_slices(size_t size, uint32_t threads) {
+    if (threads > HUFFMAN_MAX_THREADS) threads = HUFFMAN_MAX_THREADS;
+    size_t max_slices = size / HUFFMAN_MIN_SLICE_SIZE;
+    uint32_t count = (threads < max_slices) ? threads : max_slices;
+    return (count == 0) ? 1 : count;
+}
+
+static huffman_slice_t* huffman_split_slices(uint8_t* data, size_t size, uint32_t count, const huffman_allocator_t* allocator) {
+    huffman_slice_t* slices = huffman_alloc(allocator, count * sizeof(huffman_slice_t));
+    size_t slice_size = size / count;
+    for (uint32_t i = 0; i < count; i++) {
+        memset(&slices[i], 0, sizeof(huffman_slice_t));
+        slices[i].data = data + i * slice_size;
+        slices[i].size = (i == count - 1) ? size - i * slice_size : slice_size;
+    }
+    return slices;
+}
+
+static huffman_cdata_t* huffman_do_compress(uint8_t* data, size_t size, uint32_t threads, const huffman_allocator_t* allocator, bool verbose) {
     uint32_t hist[256];
     char* codes[256];
+    huffman_slice_t* slices = NULL;
     huffman_header_t header;
     memset(&header, 0, sizeof(header));
     header.orig_size = size;
-    header.nodes_count = huffman_histogram(hist, data, header.orig_size);
-    huffman_node_t** nodes_array = huffman_alloc_nodes_array(header.nodes_count);
-    huffman_create_nodes(nodes_array, hist);
-    huffman_node_t* root = huffman_build_tree(nodes_array, header.nodes_count);
-    huffman_construct_code(root, codes);
+    uint32_t count = huffman_count_slices(size, threads);
+    if (count == 1) {
+        header.nodes_count = huffman_histogram(hist, data, header.orig_size);
+    }
+    else {
+        slices = huffman_split_slices(data, size, count, allocator);
+        huffman_run_slices(slices, count, huffman_slice_histogram);
+        memset(hist, 0, sizeof(hist));
+        header.nodes_count = 0;
+        for (uint32_t j = 0; j < 256; j++) {
+            for (uint32_t i = 0; i < count; i++) hist[j] += slices[i].hist[j];
+            if (hist[j] > 0) header.nodes_count++;
+        }
+    }
+    huffman_node_t** nodes_array = huffman_alloc_nodes_array(header.nodes_count, allocator);
+    huffman_create_nodes(nodes_array, hist, allocator);
+    huffman_node_t* root = huffman_build_tree(nodes_array, header.nodes_count, allocator);
+    huffman_construct_code(root, codes, allocator);
     //huffman_show_tree(root, 0);
-    header.bs = bits_create();
+    header.bs = bits_create(allocator);
     header.bit_index = 0;
     huffman_encode_header(&header, hist);
-    printf("Header on compress\n");
-    huffman_print_header_info(&header);
-    huffman_encode_data(&header, data, codes);
+    if (verbose) {
+        printf("Header on compress\n");
+        huffman_print_header_info(&header);
+    }
+    if (count == 1) huffman_encode_data(&header, data, codes);
+    else            huffman_encode_data_parallel(&header, slices, count, codes);
     bits_trunc_to_bit_index(header.bs, header.bit_index);
-    huffman_cdata_t* cdata = malloc(sizeof(huffman_cdata_t));
-    if (cdata == NULL) utils_fatal_error("huffman_compress() failed");
+    huffman_cdata_t* cdata = huffman_alloc(allocator, sizeof(huffman_cdata_t));
     cdata->size = header.bs->size_in_bytes;
     cdata->data = header.bs->data;
     header.bs->data = NULL;
     bits_destroy(header.bs);
-    free(nodes_array);
-    huffman_destroy_tree(root);
+    huffman_free(allocator, slices);
+    huffman_free(allocator, nodes_array);
+    huffman_destroy_tree(root, allocator);
     return cdata;
 }
 
+huffman_cdata_t* huffman_compress_parallel(uint8_t* data, size_t size, uint32_t threads, const huffman_allocator_t* allocator) {
+    return huffman_do_compress(data, size, threads, allocator, huffman_verbose);
+}
+
 static void huffman_get_header_info(huffman_header_t* header, uint8_t* cdata) {
     uint8_t guide = cdata[0];
     header->bitmap = (guide >> 7);
@@ -303,19 +462,19 @@ static void huffman_get_header_info(huffman_header_t* header, uint8_t* cdata) {
             header->orig_size = (cdata[1]<<8)|(cdata[2]);
             break;
         case 4:
-            header->orig_size  = ((cdata[1]<<8)|(cdata[2])) << 16;
+            header->orig_size  = (uint32_t)((cdata[1]<<8)|(cdata[2])) << 16;
             header->orig_size |= ((cdata[3]<<8)|(cdata[4]));
             break;
     }
     header->freq_max_bits = cdata[1 + header->orig_size_max_bytes];
 }
 
-static void huffman_rec_hist_with_bitmap(huffman_header_t* header, uint8_t* cdata, uint32_t* hist) {
+static void huffman_rec_hist_with_bitmap(huffman_header_t* header, uint8_t* cdata, uint32_t* hist, const huffman_allocator_t* allocator) {
     uint8_t* bitmap_start = cdata + 1 + header->orig_size_max_bytes + 1;
-    bits_t* bs_bitmap = bits_create_from_data(bitmap_start, 256/8);
+    bits_t* bs_bitmap = bits_create_from_data(bitmap_start, 256/8, allocator);
     header->nodes_count = bits_count_bits_set_in_range(bs_bitmap, 0, 255);
     uint8_t* freq_start = bitmap_start + (256/8);
-    bits_t* bs_freq = bits_create_from_data(freq_start, 256/8);
+    bits_t* bs_freq = bits_create_from_data(freq_start, 256/8, allocator);
     for (uint32_t i = 0; i < 256; i++) {
         if (!bits_read_bit_at(bs_bitmap, i)) continue;
         // how many nodes before me?
@@ -337,10 +496,10 @@ static void huffman_rec_hist_with_bitmap(huffman_header_t* header, uint8_t* cdat
     bits_destroy(bs_freq);
 }
 
-static void huffman_rec_hist(huffman_header_t* header, uint8_t* cdata, uint32_t* hist) {
+static void huffman_rec_hist(huffman_header_t* header, uint8_t* cdata, uint32_t* hist, const huffman_allocator_t* allocator) {
     memset(hist, 0, 256 * sizeof(uint32_t));
     if (header->bitmap) {
-        huffman_rec_hist_with_bitmap(header, cdata, hist);
+        huffman_rec_hist_with_bitmap(header, cdata, hist, allocator);
     }
     else {
         header->nodes_count = cdata[1 + header->orig_size_max_bytes + 1];
@@ -349,7 +508,7 @@ static void huffman_rec_hist(huffman_header_t* header, uint8_t* cdata, uint32_t*
         size_t total_bits = header->nodes_count * header->freq_max_bits;
         size_t round_up = (((total_bits + 7) / 8) * 8) / 8;
         size_t bit_index = 0;
-        bits_t* bs = bits_create_from_data(freq_start, round_up);
+        bits_t* bs = bits_create_from_data(freq_start, round_up, allocator);
         for (uint32_t i = 0; i < header->nodes_count; i++) {
             uint32_t freq = 0;
             for (uint32_t j = 0; j < header->freq_max_bits; j++) {
@@ -365,58 +524,523 @@ static void huffman_rec_hist(huffman_header_t* header, uint8_t* cdata, uint32_t*
     }
 }
 
-static uint8_t* huffman_decompress_data(huffman_header_t* header, huffman_node_t* root, uint8_t* cdata, size_t* write_size) {
-    uint8_t* freq_start = NULL;
+static size_t huffman_header_size_in_bits(huffman_header_t* header) {
+    size_t bits = 8 + 8 * header->orig_size_max_bytes + 8;
+    if (header->bitmap) bits += 256;
+    else                bits += 8 + 8 * header->nodes_count;
+    return bits + header->nodes_count * header->freq_max_bits;
+}
+
+// Checks the header at cdata against the size bytes available and recovers
+// its histogram. Returns the header size in bits, 0 when it is malformed.
+static size_t huffman_check_header(huffman_header_t* header, uint8_t* cdata, size_t size, uint32_t* hist, const huffman_allocator_t* allocator) {
+    memset(header, 0, sizeof(huffman_header_t));
+    if (size < 1) return 0;
+    uint8_t guide = cdata[0];
+    uint8_t size_bytes = guide & 0b111;
+    if ((guide & 0x78) != 0 || (size_bytes != 1 && size_bytes != 2 && size_bytes != 4)) return 0;
+    size_t prefix = 1 + size_bytes + 1;
+    if (size < prefix) return 0;
+    huffman_get_header_info(header, cdata);
+    if (header->freq_max_bits == 0 || header->freq_max_bits > 32) return 0;
     if (header->bitmap) {
-        uint8_t* bitmap_start = cdata + 1 + header->orig_size_max_bytes + 1;
-        freq_start = bitmap_start + (256/8);
+        if (size < prefix + 256/8) return 0;
+        for (uint32_t i = 0; i < 256/8; i++)
+            header->nodes_count += __builtin_popcount(cdata[prefix + i]);
     }
     else {
-        uint8_t* symbols_start = cdata + 1 + header->orig_size_max_bytes + 1 + 1;
-        freq_start = symbols_start + header->nodes_count * sizeof(uint8_t);
-    }
-    bits_t* bs = bits_create_from_data(freq_start, header->orig_size);
-    size_t bit_index = header->nodes_count * header->freq_max_bits;;
-    uint8_t* data = malloc(header->orig_size);
-    if (data == NULL) utils_fatal_error("huffman_decompress_data() failed");
-    uint32_t decoded = 0;
-    if (root == NULL) utils_fatal_error("huffman_decompress_data() failed");
-    while (decoded < header->orig_size) {
+        if (size < prefix + 1) return 0;
+        header->nodes_count = cdata[prefix];
+    }
+    if (header->nodes_count == 0) return 0;
+    size_t header_bits = huffman_header_size_in_bits(header);
+    if (header_bits > size * 8) return 0;
+
+    huffman_rec_hist(header, cdata, hist, allocator);
+    uint64_t total = 0;
+    uint32_t nodes_count = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+        if (hist[i] == 0) continue;
+        total += hist[i];
+        nodes_count++;
+    }
+    if (nodes_count != header->nodes_count || total != header->orig_size) return 0;
+    return header_bits;
+}
+
+static uint64_t huffman_code_bits(huffman_node_t* node, uint32_t depth) {
+    if (is_leaf(node)) return (uint64_t)node->freq * (depth > 0 ? depth : 1);
+    return huffman_code_bits(node->left, depth + 1) + huffman_code_bits(node->right, depth + 1);
+}
+
+static void huffman_close_segment(huffman_segment_t* segment, const huffman_allocator_t* allocator) {
+    huffman_free(allocator, segment->nodes_array);
+    huffman_destroy_tree(segment->root, allocator);
+    segment->nodes_array = NULL;
+    segment->root = NULL;
+}
+
+// Fails unless the header is valid and the code bits it implies fit in size bytes.
+static bool huffman_open_segment(huffman_segment_t* segment, uint8_t* cdata, size_t size, const huffman_allocator_t* allocator) {
+    uint32_t hist[256];
+    size_t header_bits = huffman_check_header(&segment->header, cdata, size, hist, allocator);
+    if (header_bits == 0) return false;
+    segment->data = cdata;
+    segment->nodes_array = huffman_alloc_nodes_array(segment->header.nodes_count, allocator);
+    huffman_create_nodes(segment->nodes_array, hist, allocator);
+    segment->root = huffman_build_tree(segment->nodes_array, segment->header.nodes_count, allocator);
+    //huffman_show_tree(segment->root, 0);
+    segment->bit_index = header_bits;
+    segment->end_bit = header_bits + huffman_code_bits(segment->root, 0);
+    if (segment->end_bit > size * 8) {
+        huffman_close_segment(segment, allocator);
+        return false;
+    }
+    return true;
+}
+
+static size_t huffman_segment_size(huffman_segment_t* segment) {
+    return (segment->end_bit + 7) / 8;
+}
+
+// Decodes the next count symbols, fails instead of reading past end_bit.
+static bool huffman_decode_symbols(huffman_segment_t* segment, uint8_t* out, size_t count) {
+    huffman_node_t* root = segment->root;
+    uint8_t* in = segment->data;
+    size_t bit_index = segment->bit_index;
+    size_t end_bit = segment->end_bit;
+    if (is_leaf(root)) {
+        if (count > end_bit - bit_index) return false;
+        memset(out, root->byte, count);
+        segment->bit_index += count;
+        return true;
+    }
+    for (size_t decoded = 0; decoded < count; decoded++) {
         huffman_node_t* node = root;
-        while (node != NULL && !is_leaf(node)) {
-            if (bits_read_bit_at(bs, bit_index++))
+        while (!is_leaf(node)) {
+            if (bit_index >= end_bit) return false;
+            if ((in[bit_index / 8] >> (7 - (bit_index % 8))) & 1)
                 node = node->right;
             else
                 node = node->left;
+            bit_index++;
+        }
+        out[decoded] = node->byte;
+    }
+    segment->bit_index = bit_index;
+    return true;
+}
+
+static huffman_node_t* huffman_read_table(huffman_header_t* header, uint8_t* cdata, size_t size, huffman_node_t*** nodes_array, const huffman_allocator_t* allocator) {
+    uint32_t hist[256];
+    if (huffman_check_header(header, cdata, size, hist, allocator) == 0) return NULL;
+    *nodes_array = huffman_alloc_nodes_array(header->nodes_count, allocator);
+    huffman_create_nodes(*nodes_array, hist, allocator);
+    return huffman_build_tree(*nodes_array, header->nodes_count, allocator);
+}
+
+static void huffman_write_u32(uint8_t* out, uint32_t value) {
+    uint32_t be = htonl(value);
+    memcpy(out, &be, sizeof(be));
+}
+
+static uint32_t huffman_read_u32(const uint8_t* in) {
+    uint32_t be;
+    memcpy(&be, in, sizeof(be));
+    return ntohl(be);
+}
+
+uint32_t huffman_footer_count(const uint8_t* footer) {
+    if (huffman_read_u32(footer) != HUFFMAN_FOOTER_MAGIC) return 0;
+    return huffman_read_u32(footer + 4);
+}
+
+void huffman_write_footer(uint8_t* out, uint32_t count) {
+    huffman_write_u32(out, HUFFMAN_FOOTER_MAGIC);
+    huffman_write_u32(out + 4, count);
+}
+
+// Walks the self-delimiting segments and the footers between them. A footer
+// byte is never a valid guide byte, so footers left behind by earlier appends
+// are told apart from segments. Only a lone first segment or a footer counting
+// every segment before it ends a committed prefix.
+static size_t* huffman_find_segments(uint8_t* cdata, size_t cdata_size, uint32_t* count, size_t* committed, const huffman_allocator_t* allocator) {
+    size_t* offsets = NULL;
+    size_t capacity = 0;
+    uint32_t n = 0;
+    size_t offset = 0;
+    *count = 0;
+    *committed = 0;
+    while (offset < cdata_size) {
+        if (cdata_size - offset >= HUFFMAN_FOOTER_SIZE && huffman_read_u32(cdata + offset) == HUFFMAN_FOOTER_MAGIC) {
+            if (huffman_footer_count(cdata + offset) != n) break;
+            offset += HUFFMAN_FOOTER_SIZE;
+            *count = n;
+            *committed = offset;
+            continue;
+        }
+        huffman_segment_t segment;
+        if (!huffman_open_segment(&segment, cdata + offset, cdata_size - offset, allocator)) break;
+        size_t size = huffman_segment_size(&segment);
+        huffman_close_segment(&segment, allocator);
+        if (n == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 4;
+            offsets = huffman_realloc(allocator, offsets, capacity * sizeof(size_t), new_capacity * sizeof(size_t));
+            capacity = new_capacity;
+        }
+        offsets[n++] = offset;
+        offset += size;
+        if (n == 1) {
+            *count = 1;
+            *committed = offset;
+        }
+    }
+    return offsets;
+}
+
+size_t huffman_committed_size(uint8_t* cdata, size_t cdata_size, uint32_t* count, const huffman_allocator_t* allocator) {
+    size_t committed = 0;
+    huffman_free(allocator, huffman_find_segments(cdata, cdata_size, count, &committed, allocator));
+    return committed;
+}
+
+uint64_t huffman_decompressed_size(uint8_t* cdata, size_t cdata_size, const huffman_allocator_t* allocator) {
+    uint32_t count = 0;
+    size_t committed = 0;
+    size_t* offsets = huffman_find_segments(cdata, cdata_size, &count, &committed, allocator);
+    uint64_t total = 0;
+    if (committed > 0 && committed == cdata_size) {
+        for (uint32_t i = 0; i < count; i++) {
+            huffman_header_t header;
+            uint32_t hist[256];
+            huffman_check_header(&header, cdata + offsets[i], cdata_size - offsets[i], hist, allocator);
+            total += header.orig_size;
         }
-        data[decoded++] = node->byte;
     }
-    bs->data = NULL;
-    bits_destroy(bs);
+    huffman_free(allocator, offsets);
+    return total;
+}
+
+static void huffman_print_segment_header(huffman_segment_t* segment) {
+    if (!huffman_verbose) return;
+    printf("Header on decompress\n");
+    huffman_print_header_info(&segment->header);
+}
+
+uint8_t* huffman_decompress(uint8_t* cdata, size_t cdata_size, size_t* write_size) {
+    return huffman_decompress_with_allocator(cdata, cdata_size, write_size, NULL);
+}
+
+uint8_t* huffman_decompress_with_allocator(uint8_t* cdata, size_t cdata_size, size_t* write_size, const huffman_allocator_t* allocator) {
+    uint8_t* data = huffman_try_decompress(cdata, cdata_size, write_size, allocator);
+    if (data == NULL) utils_fatal_error("huffman_decompress() failed - corrupt stream");
+    return data;
+}
+
+uint8_t* huffman_try_decompress(uint8_t* cdata, size_t cdata_size, size_t* write_size, const huffman_allocator_t* allocator) {
+    uint32_t count = 0;
+    size_t committed = 0;
+    size_t* offsets = huffman_find_segments(cdata, cdata_size, &count, &committed, allocator);
+    uint8_t* data = NULL;
+    size_t decoded = 0;
+    // trailing bytes are an unfinished append or garbage, never silently dropped
+    bool ok = committed > 0 && committed == cdata_size;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        huffman_segment_t segment;
+        if (!huffman_open_segment(&segment, cdata + offsets[i], cdata_size - offsets[i], allocator)) {
+            ok = false;
+            break;
+        }
+        huffman_print_segment_header(&segment);
+        size_t orig_size = segment.header.orig_size;
+        data = huffman_realloc(allocator, data, decoded, decoded + orig_size);
+        ok = huffman_decode_symbols(&segment, data + decoded, orig_size);
+        decoded += orig_size;
+        huffman_close_segment(&segment, allocator);
+    }
+    huffman_free(allocator, offsets);
+    if (!ok) {
+        huffman_free(allocator, data);
+        return NULL;
+    }
     *write_size = decoded;
     return data;
 }
 
-uint8_t* huffman_decompress(uint8_t* cdata, size_t cdata_size, size_t* write_size) {
+// Returns false if the segment's code bits are corrupt.
+static bool huffman_segment_to_sink(huffman_segment_t* segment, huffman_sink_fn sink, void* ctx, uint8_t* window, size_t window_size, size_t* delivered, bool* stopped) {
+    size_t done = 0;
+    while (done < segment->header.orig_size) {
+        size_t count = segment->header.orig_size - done;
+        if (count > window_size) count = window_size;
+        if (!huffman_decode_symbols(segment, window, count)) return false;
+        done += count;
+        *delivered += count;
+        if (!sink(ctx, window, count)) {
+            *stopped = true;
+            break;
+        }
+    }
+    return true;
+}
+
+bool huffman_decompress_to_sink(uint8_t* cdata, size_t cdata_size, huffman_sink_fn sink, void* ctx, size_t window_size, size_t* delivered, const huffman_allocator_t* allocator) {
+    uint32_t count = 0;
+    size_t committed = 0;
+    size_t* offsets = huffman_find_segments(cdata, cdata_size, &count, &committed, allocator);
+    *delivered = 0;
+    if (committed == 0 || committed != cdata_size) {
+        huffman_free(allocator, offsets);
+        return false;
+    }
+    // every symbol takes at least one bit
+    if (window_size == 0) window_size = HUFFMAN_SINK_WINDOW_SIZE;
+    if (window_size > cdata_size * 8) window_size = cdata_size * 8;
+    uint8_t* window = huffman_alloc(allocator, window_size);
+    bool ok = true;
+    bool stopped = false;
+    for (uint32_t i = 0; i < count && ok && !stopped; i++) {
+        huffman_segment_t segment;
+        if (!huffman_open_segment(&segment, cdata + offsets[i], cdata_size - offsets[i], allocator)) {
+            ok = false;
+            break;
+        }
+        huffman_print_segment_header(&segment);
+        ok = huffman_segment_to_sink(&segment, sink, ctx, window, window_size, delivered, &stopped);
+        huffman_close_segment(&segment, allocator);
+    }
+    huffman_free(allocator, window);
+    huffman_free(allocator, offsets);
+    return ok;
+}
+
+static huffman_batch_t* huffman_batch_create(size_t count, bool shared_table, const huffman_allocator_t* allocator) {
+    huffman_batch_t* batch = huffman_alloc(allocator, sizeof(huffman_batch_t));
+    batch->data = NULL;
+    batch->size = 0;
+    batch->capacity = 0;
+    batch->offsets = huffman_alloc(allocator, (count + 1) * sizeof(size_t));
+    batch->offsets[0] = 0;
+    batch->count = count;
+    batch->shared_table = shared_table;
+    return batch;
+}
+
+static uint8_t* huffman_batch_reserve(huffman_batch_t* batch, size_t size, const huffman_allocator_t* allocator) {
+    if (batch->size + size > batch->capacity) {
+        size_t capacity = batch->capacity * 2;
+        if (capacity < batch->size + size) capacity = batch->size + size;
+        batch->data = huffman_realloc(allocator, batch->data, batch->capacity, capacity);
+        batch->capacity = capacity;
+    }
+    uint8_t* out = batch->data + batch->size;
+    batch->size += size;
+    return out;
+}
+
+void huffman_batch_destroy(huffman_batch_t* batch, const huffman_allocator_t* allocator) {
+    huffman_free(allocator, batch->data);
+    huffman_free(allocator, batch->offsets);
+    huffman_free(allocator, batch);
+}
+
+// Shared-table layout: data[0, offsets[0]) is one header for the whole
+// batch, each record is its 4-byte original size followed by its
+// byte-aligned code bits.
+static void huffman_compress_batch_shared(huffman_batch_t* batch, const huffman_record_t* records, size_t count, const huffman_allocator_t* allocator) {
     uint32_t hist[256];
     char* codes[256];
-    huffman_header_t header;
-    memset(&header, 0, sizeof(huffman_header_t));
-    huffman_get_header_info(&header, cdata);
-    huffman_rec_hist(&header, cdata, hist);
-    printf("Header on decompress\n");
-    huffman_print_header_info(&header);
+    size_t code_len[256];
+    size_t total = 0;
+    memset(hist, 0, sizeof(hist));
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < records[i].size; j++) hist[records[i].data[j]]++;
+        total += records[i].size;
+    }
+    if (total > 0xffffffff) utils_fatal_error("huffman_compress_batch() failed - batch too big");
+
+    huffman_node_t** nodes_array = NULL;
+    huffman_node_t* root = NULL;
+    memset(codes, 0, sizeof(codes));
+    if (total > 0) {
+        huffman_header_t header;
+        memset(&header, 0, sizeof(header));
+        header.orig_size = total;
+        huffman_fill_header_for_encode(&header, hist);
+        nodes_array = huffman_alloc_nodes_array(header.nodes_count, allocator);
+        huffman_create_nodes(nodes_array, hist, allocator);
+        root = huffman_build_tree(nodes_array, header.nodes_count, allocator);
+        huffman_construct_code(root, codes, allocator);
+        header.bs = bits_create(allocator);
+        header.bit_index = 0;
+        huffman_encode_header(&header, hist);
+        bits_trunc_to_bit_index(header.bs, header.bit_index);
+        memcpy(huffman_batch_reserve(batch, header.bs->size_in_bytes, allocator), header.bs->data, header.bs->size_in_bytes);
+        bits_destroy(header.bs);
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        code_len[i] = (codes[i] != NULL) ? strlen(codes[i]) : 0;
 
-    if (header.orig_size > (4 * cdata_size))
-        utils_fatal_error("huffman_decompress() failed - unreal");
+    batch->offsets[0] = batch->size;
+    for (size_t i = 0; i < count; i++) {
+        size_t bits = 0;
+        for (size_t j = 0; j < records[i].size; j++) bits += code_len[records[i].data[j]];
+        uint8_t* out = huffman_batch_reserve(batch, 4 + (bits + 7) / 8, allocator);
+        huffman_write_u32(out, records[i].size);
+        huffman_slice_t slice;
+        memset(&slice, 0, sizeof(slice));
+        slice.data = records[i].data;
+        slice.size = records[i].size;
+        slice.codes = codes;
+        slice.out = out + 4;
+        huffman_slice_encode(&slice);
+        if (slice.has_tail) slice.out[slice.tail_index] = slice.tail;
+        batch->offsets[i + 1] = batch->size;
+    }
+    huffman_free(allocator, nodes_array);
+    huffman_destroy_tree(root, allocator);
+}
 
-    huffman_node_t** nodes_array = huffman_alloc_nodes_array(header.nodes_count);
-    huffman_create_nodes(nodes_array, hist);
-    huffman_node_t* root = huffman_build_tree(nodes_array, header.nodes_count);
-    huffman_construct_code(root, codes);
-    //huffman_show_tree(root, 0);
-    uint8_t* data = huffman_decompress_data(&header, root, cdata, write_size);
-    free(nodes_array);
-    huffman_destroy_tree(root);
-    return data;
+huffman_batch_t* huffman_compress_batch(const huffman_record_t* records, size_t count, bool shared_table, const huffman_allocator_t* allocator) {
+    huffman_batch_t* batch = huffman_batch_create(count, shared_table, allocator);
+    size_t estimate = 0;
+    for (size_t i = 0; i < count; i++) estimate += records[i].size + 4;
+    huffman_batch_reserve(batch, estimate, allocator);
+    batch->size = 0;
+    if (shared_table) {
+        huffman_compress_batch_shared(batch, records, count, allocator);
+        return batch;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].size > 0) {
+            huffman_cdata_t* cdata = huffman_do_compress(records[i].data, records[i].size, 1, allocator, false);
+            memcpy(huffman_batch_reserve(batch, cdata->size, allocator), cdata->data, cdata->size);
+            huffman_free(allocator, cdata->data);
+            huffman_free(allocator, cdata);
+        }
+        batch->offsets[i + 1] = batch->size;
+    }
+    return batch;
+}
+
+typedef struct {
+    uint8_t* in;
+    size_t bit_index;
+    size_t end_bit;
+    uint8_t* out;
+    size_t remaining;
+    huffman_node_t* node;
+} huffman_lane_t;
+
+static bool huffman_lane_load(huffman_lane_t* lane, const huffman_batch_t* batch, huffman_batch_t* out, size_t* next, huffman_node_t* root) {
+    while (*next < batch->count) {
+        size_t i = (*next)++;
+        uint8_t* record = batch->data + batch->offsets[i];
+        size_t size = out->offsets[i + 1] - out->offsets[i];
+        if (size == 0) continue;
+        if (is_leaf(root)) {
+            memset(out->data + out->offsets[i], root->byte, size);
+            continue;
+        }
+        lane->in = record + 4;
+        lane->bit_index = 0;
+        lane->end_bit = (batch->offsets[i + 1] - batch->offsets[i] - 4) * 8;
+        lane->out = out->data + out->offsets[i];
+        lane->remaining = size;
+        lane->node = root;
+        return true;
+    }
+    lane->remaining = 0;
+    return false;
+}
+
+// Walks HUFFMAN_BATCH_LANES records through the tree in lockstep, one edge
+// per lane per round, so their dependent loads overlap instead of queueing.
+static void huffman_decompress_batch_shared(const huffman_batch_t* batch, huffman_batch_t* out, huffman_node_t* root) {
+    huffman_lane_t lanes[HUFFMAN_BATCH_LANES];
+    size_t next = 0;
+    uint32_t active = 0;
+    for (uint32_t l = 0; l < HUFFMAN_BATCH_LANES; l++)
+        if (root != NULL && huffman_lane_load(&lanes[l], batch, out, &next, root)) active++;
+    while (active > 0) {
+        for (uint32_t l = 0; l < HUFFMAN_BATCH_LANES; l++) {
+            huffman_lane_t* lane = &lanes[l];
+            if (lane->remaining == 0) continue;
+            if (lane->bit_index >= lane->end_bit)
+                utils_fatal_error("huffman_decompress_batch() failed - corrupt record");
+            bool bit = (lane->in[lane->bit_index / 8] >> (7 - (lane->bit_index % 8))) & 1;
+            lane->bit_index++;
+            lane->node = bit ? lane->node->right : lane->node->left;
+            if (!is_leaf(lane->node)) continue;
+            *lane->out++ = lane->node->byte;
+            lane->node = root;
+            if (--lane->remaining == 0 && !huffman_lane_load(lane, batch, out, &next, root))
+                active--;
+        }
+    }
+}
+
+// Validates record i's bounds and header and returns its decoded size.
+// Every symbol takes at least one bit, which caps the size by the record length.
+static size_t huffman_batch_record_size(const huffman_batch_t* batch, size_t i, const huffman_allocator_t* allocator) {
+    size_t start = batch->offsets[i];
+    size_t end = batch->offsets[i + 1];
+    if (end < start || end > batch->size)
+        utils_fatal_error("huffman_decompress_batch() failed - corrupt offsets");
+    uint8_t* record = batch->data + start;
+    size_t size = 0;
+    size_t bits = 0;
+    if (batch->shared_table) {
+        if (end - start < 4) utils_fatal_error("huffman_decompress_batch() failed - corrupt record");
+        size = huffman_read_u32(record);
+        bits = (end - start - 4) * 8;
+    }
+    else if (end > start) {
+        huffman_header_t header;
+        uint32_t hist[256];
+        if (huffman_check_header(&header, record, end - start, hist, allocator) == 0)
+            utils_fatal_error("huffman_decompress_batch() failed - corrupt record");
+        size = header.orig_size;
+        bits = (end - start) * 8;
+    }
+    if (size > bits) utils_fatal_error("huffman_decompress_batch() failed - corrupt record");
+    return size;
+}
+
+huffman_batch_t* huffman_decompress_batch(const huffman_batch_t* batch, const huffman_allocator_t* allocator) {
+    huffman_header_t header;
+    huffman_node_t** nodes_array = NULL;
+    huffman_node_t* root = NULL;
+    memset(&header, 0, sizeof(header));
+    if (batch->offsets[0] > batch->size)
+        utils_fatal_error("huffman_decompress_batch() failed - corrupt offsets");
+    if (batch->shared_table && batch->offsets[0] > 0) {
+        root = huffman_read_table(&header, batch->data, batch->offsets[0], &nodes_array, allocator);
+        if (root == NULL) utils_fatal_error("huffman_decompress_batch() failed - corrupt table");
+    }
+
+    huffman_batch_t* out = huffman_batch_create(batch->count, false, allocator);
+    for (size_t i = 0; i < batch->count; i++)
+        out->offsets[i + 1] = out->offsets[i] + huffman_batch_record_size(batch, i, allocator);
+    // the shared table's orig_size is the whole batch
+    if (batch->shared_table && out->offsets[batch->count] != header.orig_size)
+        utils_fatal_error("huffman_decompress_batch() failed - sizes do not match the table");
+    huffman_batch_reserve(out, out->offsets[batch->count], allocator);
+    if (batch->shared_table) {
+        huffman_decompress_batch_shared(batch, out, root);
+        huffman_free(allocator, nodes_array);
+        huffman_destroy_tree(root, allocator);
+        return out;
+    }
+    for (size_t i = 0; i < batch->count; i++) {
+        size_t size = out->offsets[i + 1] - out->offsets[i];
+        if (size == 0) continue;
+        huffman_segment_t segment;
+        uint8_t* record = batch->data + batch->offsets[i];
+        if (!huffman_open_segment(&segment, record, batch->offsets[i + 1] - batch->offsets[i], allocator) ||
+            !huffman_decode_symbols(&segment, out->data + out->offsets[i], size))
+            utils_fatal_error("huffman_decompress_batch() failed - corrupt record");
+        huffman_close_segment(&segment, allocator);
+    }
+    return out;
 }
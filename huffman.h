@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "allocator.h"
 #include "bitstream.h"
 
 
@@ -30,7 +31,53 @@ typedef struct {
     size_t bit_index;
 } huffman_header_t;
 
+#define HUFFMAN_BATCH_LANES     4
+#define HUFFMAN_SINK_WINDOW_SIZE  (64 * 1024)
+
+// Appending adds a segment, then a footer: magic (4 bytes) | segment count (4).
+// Footers of earlier appends stay in place, the last one must count every segment.
+#define HUFFMAN_FOOTER_MAGIC      0x48554653
+#define HUFFMAN_FOOTER_SIZE       8
+
+// Receives each decoded window, return false to stop decoding.
+typedef bool (*huffman_sink_fn)(void* ctx, const uint8_t* data, size_t size);
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} huffman_record_t;
+
+// Record i lives in data[offsets[i], offsets[i+1]). With shared_table the
+// batch header sits in data[0, offsets[0]) and records carry only code bits.
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    size_t* offsets;
+    size_t count;
+    bool shared_table;
+} huffman_batch_t;
+
+void huffman_set_verbose(bool verbose);
 huffman_cdata_t* huffman_compress(uint8_t* data, size_t size);
 uint8_t* huffman_decompress(uint8_t* cdata, size_t cdata_size, size_t* write_size);
+huffman_cdata_t* huffman_compress_with_allocator(uint8_t* data, size_t size, const huffman_allocator_t* allocator);
+huffman_cdata_t* huffman_compress_parallel(uint8_t* data, size_t size, uint32_t threads, const huffman_allocator_t* allocator);
+// Returns NULL for a malformed stream instead of exiting.
+uint8_t* huffman_try_decompress(uint8_t* cdata, size_t cdata_size, size_t* write_size, const huffman_allocator_t* allocator);
+uint8_t* huffman_decompress_with_allocator(uint8_t* cdata, size_t cdata_size, size_t* write_size, const huffman_allocator_t* allocator);
+// Returns false for a malformed stream. Windows decoded before the error was
+// found have already reached the sink; *delivered counts them.
+bool huffman_decompress_to_sink(uint8_t* cdata, size_t cdata_size, huffman_sink_fn sink, void* ctx, size_t window_size, size_t* delivered, const huffman_allocator_t* allocator);
+// Returns 0 if footer does not start with the magic.
+uint32_t huffman_footer_count(const uint8_t* footer);
+void huffman_write_footer(uint8_t* out, uint32_t count);
+// Size of the longest prefix that is a complete stream, 0 if there is none.
+size_t huffman_committed_size(uint8_t* cdata, size_t cdata_size, uint32_t* count, const huffman_allocator_t* allocator);
+// Total size huffman_try_decompress() would return, 0 for a malformed stream.
+uint64_t huffman_decompressed_size(uint8_t* cdata, size_t cdata_size, const huffman_allocator_t* allocator);
+huffman_batch_t* huffman_compress_batch(const huffman_record_t* records, size_t count, bool shared_table, const huffman_allocator_t* allocator);
+huffman_batch_t* huffman_decompress_batch(const huffman_batch_t* batch, const huffman_allocator_t* allocator);
+void huffman_batch_destroy(huffman_batch_t* batch, const huffman_allocator_t* allocator);
 
 #endif
\ No newline at end of file
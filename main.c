@@ -12,13 +12,18 @@
 #include "huffman.h"
 #include "bitstream.h"
 #include "utils.h"
+#include "server.h"
 
 
 typedef struct {
     char *input_file;
     char *output_file;
+    char *serve_socket;
+    uint32_t workers;
+    uint32_t threads;
     bool encode;
     bool decode;
+    bool append;
     bool errors;
 } program_opts_t;
 
@@ -52,10 +57,10 @@ void write_file(const char *path, uint8_t* data, size_t size) {
 }
 
 
-void huffman_compress_file(const char* input_file, const char* output_file) {
+void huffman_compress_file(const char* input_file, const char* output_file, uint32_t threads) {
     size_t size = 0;
     uint8_t* data = read_file(input_file, &size);
-    huffman_cdata_t* cdata = huffman_compress(data, size);
+    huffman_cdata_t* cdata = huffman_compress_parallel(data, size, threads, NULL);
     write_file(output_file, cdata->data, cdata->size);
     printf("Original   size: %ld\n", size);
     printf("Compressed size: %ld\n", cdata->size);
@@ -72,26 +77,136 @@ void huffman_compress_file(const char* input_file, const char* output_file) {
 }
 
 
+void pread_full(int fd, uint8_t* data, size_t size, size_t offset) {
+    ssize_t bytes_read = pread(fd, data, size, offset);
+    if (bytes_read < 0 || (size_t)bytes_read < size) utils_fatal_error("Could not read all content");
+}
+
+void pwrite_full(int fd, const uint8_t* data, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t bytes_written = pwrite(fd, data, size, offset);
+        if (bytes_written < 0) utils_fatal_error("Could not write all content");
+        data += bytes_written;
+        size -= (size_t)bytes_written;
+        offset += (size_t)bytes_written;
+    }
+}
+
+void sync_file(int fd) {
+    if (fsync(fd) == -1) utils_fatal_error("Could not sync output file");
+}
+
+// Appends a new segment after the end of output_file, then a footer with the
+// new segment count. Nothing already written is overwritten and the segment
+// is synced before the footer, so a crash leaves the previous footer last.
+void huffman_append_file(const char* input_file, const char* output_file, uint32_t threads) {
+    size_t size = 0;
+    uint8_t* data = read_file(input_file, &size);
+    // an empty stream has no table and would not decode, so there is no segment to add
+    if (size == 0) {
+        printf("Nothing to append\n");
+        free(data);
+        return;
+    }
+    huffman_cdata_t* cdata = huffman_compress_parallel(data, size, threads, NULL);
+    // never commit a segment the decoder would stop at
+    uint32_t segment_count = 0;
+    if (huffman_committed_size(cdata->data, cdata->size, &segment_count, NULL) != cdata->size)
+        utils_fatal_error("Could not append - new segment does not decode");
+    int fd = open(output_file, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    if (fd < 0) utils_fatal_error("Could not open file for appending");
+    size_t file_size = get_file_size(output_file);
+
+    uint32_t count = 0;
+    if (file_size >= HUFFMAN_FOOTER_SIZE) {
+        uint8_t footer[HUFFMAN_FOOTER_SIZE];
+        pread_full(fd, footer, sizeof(footer), file_size - sizeof(footer));
+        count = huffman_footer_count(footer);
+    }
+    // a lone segment, or the tail of an append that did not finish
+    if (count == 0 && file_size > 0) {
+        size_t old_size = 0;
+        uint8_t* old_data = read_file(output_file, &old_size);
+        size_t committed = huffman_committed_size(old_data, old_size, &count, NULL);
+        free(old_data);
+        if (committed == 0) utils_fatal_error("Output file is not a compressed file");
+        if (committed < file_size) {
+            printf("Dropping %ld bytes of an unfinished append\n", file_size - committed);
+            if (ftruncate(fd, committed) == -1) utils_fatal_error("Could not truncate output file");
+            file_size = committed;
+        }
+    }
+
+    pwrite_full(fd, cdata->data, cdata->size, file_size);
+    if (count > 0) {
+        uint8_t footer[HUFFMAN_FOOTER_SIZE];
+        huffman_write_footer(footer, count + 1);
+        sync_file(fd);
+        pwrite_full(fd, footer, sizeof(footer), file_size + cdata->size);
+    }
+    sync_file(fd);
+    close(fd);
+    count++;
+    printf("Appended   size: %ld\n", size);
+    printf("Segment    size: %ld\n", cdata->size);
+    printf("Segments:        %u\n", count);
+    free(cdata->data);
+    free(cdata);
+    free(data);
+}
+
+bool write_window(void* ctx, const uint8_t* data, size_t size) {
+    int fd = *(int*)ctx;
+    while (size > 0) {
+        ssize_t bytes_written = write(fd, data, size);
+        if (bytes_written < 0) utils_fatal_error("Could not write all content");
+        data += bytes_written;
+        size -= (size_t)bytes_written;
+    }
+    return true;
+}
+
+// Decodes into a temporary file next to output_file and renames it over
+// output_file only once the whole stream decoded.
 void huffman_decompress_file(const char* input_file, const char* output_file) {
     size_t file_size = 0;
-    size_t size_after_decode = 0;
     uint8_t* data = read_file(input_file, &file_size);
-    uint8_t* orig_data = huffman_decompress(data, file_size, &size_after_decode);
-    write_file(output_file, orig_data, size_after_decode);
+    size_t path_size = strlen(output_file) + sizeof(".XXXXXX");
+    char* tmp_path = malloc(path_size);
+    if (tmp_path == NULL) utils_fatal_error("Could not allocate memory for file name");
+    snprintf(tmp_path, path_size, "%s.XXXXXX", output_file);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) utils_fatal_error("Could not open file for writing");
+    size_t size_after_decode = 0;
+    bool ok = huffman_decompress_to_sink(data, file_size, write_window, &fd, 0, &size_after_decode, NULL);
+    close(fd);
+    if (!ok) {
+        unlink(tmp_path);
+        utils_fatal_error("Could not decompress - corrupt input file");
+    }
+    if (rename(tmp_path, output_file) == -1) {
+        unlink(tmp_path);
+        utils_fatal_error("Could not rename output file");
+    }
     printf("Original   size: %ld\n", size_after_decode);
     printf("Compressed size: %ld\n", file_size);
+    free(tmp_path);
     free(data);
-    free(orig_data);
 }
 
 int main(int argc, char** argv) {
     program_opts_t opts = parse_opts(argc, argv);
-    if (opts.errors == false) {
+    if (opts.errors == false && opts.serve_socket != NULL) {
+        server_run(opts.serve_socket, opts.workers);
+    }
+    else if (opts.errors == false) {
         printf("Input file:  %s\n", opts.input_file);
         printf("Output file: %s\n\n", opts.output_file);
 
         if (opts.encode)
-            huffman_compress_file(opts.input_file, opts.output_file);
+            huffman_compress_file(opts.input_file, opts.output_file, opts.threads);
+        else if (opts.append)
+            huffman_append_file(opts.input_file, opts.output_file, opts.threads);
         else
             huffman_decompress_file(opts.input_file, opts.output_file);
     }
@@ -103,27 +218,40 @@ program_opts_t parse_opts(int argc, char** argv) {
     program_opts_t opts;
     opts.input_file = NULL;
     opts.output_file = NULL;
+    opts.serve_socket = NULL;
+    opts.workers = 0;
+    opts.threads = 1;
     opts.encode = false;
     opts.decode = false;
+    opts.append = false;
     opts.errors = false;
     int opt;
 
     struct option long_opts[] = {
         {"encode",  no_argument,         NULL, 'e'},
         {"decode",  no_argument,         NULL, 'd'},
+        {"append",  no_argument,         NULL, 'a'},
         {"input",   required_argument,   NULL, 'i'},
         {"output",  required_argument,   NULL, 'o'},
+        {"serve",   required_argument,   NULL, 's'},
+        {"workers", required_argument,   NULL, 'w'},
+        {"threads", required_argument,   NULL, 't'},
         {NULL,                      0,   NULL,  0}
     };
 
-    while ((opt = getopt_long(argc, argv, "edi:o:", long_opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "edai:o:s:w:t:", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'e': opts.encode = true;        break;
             case 'd': opts.decode = true;        break;
+            case 'a': opts.append = true;        break;
             case 'i': opts.input_file = optarg;  break;
             case 'o': opts.output_file = optarg; break;
+            case 's': opts.serve_socket = optarg; break;
+            case 'w': opts.workers = strtoul(optarg, NULL, 10); break;
+            case 't': opts.threads = strtoul(optarg, NULL, 10); break;
             case '?':
-                fprintf(stderr, "Usage: %s [-e | -d] -i <infile> -o <outfile>\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-e | -d | -a] -i <infile> -o <outfile> [-t <threads>]\n", argv[0]);
+                fprintf(stderr, "       %s -s <socket> [-w <workers>]\n", argv[0]);
                 opts.errors = true;
                 return opts;
             default:
@@ -133,8 +261,16 @@ program_opts_t parse_opts(int argc, char** argv) {
         }
     }
 
-    if ((opts.encode && opts.decode) || (!opts.encode && !opts.decode)) {
-        fprintf(stderr, "Use either --encode or --decode, but not both.\n");
+    if (opts.serve_socket != NULL) {
+        if (opts.encode || opts.decode || opts.append) {
+            fprintf(stderr, "--serve cannot be combined with --encode, --decode or --append.\n");
+            opts.errors = true;
+        }
+        return opts;
+    }
+
+    if (opts.encode + opts.decode + opts.append != 1) {
+        fprintf(stderr, "Use exactly one of --encode, --decode or --append.\n");
         opts.errors = true;
         return opts;
     }
@@ -0,0 +1,520 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "huffman.h"
+#include "server.h"
+#include "utils.h"
+
+
+#define SERVER_HEADER_SIZE      5
+#define SERVER_MAX_CONNECTIONS  1024
+#define SERVER_POLL_INTERVAL_MS 1000
+#define SERVER_IDLE_TIMEOUT_MS  60000
+#define SERVER_IO_TIMEOUT_S     5
+#define SERVER_LATENCY_SAMPLES  4096
+#define SERVER_MAX_PAYLOAD      (1u << 30)
+#define SERVER_ARENA_CHUNK      (1u << 20)
+#define SERVER_KEEP_SIZE        (16u << 20)
+
+typedef struct {
+    int fds[SERVER_MAX_CONNECTIONS];
+    uint32_t head;
+    uint32_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} server_queue_t;
+
+// Connections workers hand back to the poll loop, plus how many they closed.
+typedef struct {
+    int fds[SERVER_MAX_CONNECTIONS];
+    uint32_t count;
+    uint32_t closed;
+    pthread_mutex_t lock;
+    int wake[2];
+} server_returns_t;
+
+typedef struct {
+    uint64_t samples[SERVER_LATENCY_SAMPLES];
+    uint64_t requests;
+    uint64_t errors;
+    pthread_mutex_t lock;
+} server_stats_t;
+
+typedef struct {
+    uint8_t* buf;
+    size_t buf_size;
+    huffman_arena_t* arena;
+    huffman_allocator_t allocator;
+    char text[256];
+} server_worker_t;
+
+typedef struct {
+    uint8_t status;
+    const uint8_t* payload;
+    size_t size;
+    bool with_payload;
+    bool keep_alive;
+} server_response_t;
+
+static server_queue_t server_queue;
+static server_returns_t server_returns;
+static server_stats_t server_stats;
+static volatile sig_atomic_t server_stop = 0;
+
+
+// Never blocks the poll loop, a full queue rejects the connection.
+static bool server_queue_push(server_queue_t* queue, int fd) {
+    pthread_mutex_lock(&queue->lock);
+    bool pushed = (queue->count < SERVER_MAX_CONNECTIONS);
+    if (pushed) {
+        queue->fds[(queue->head + queue->count) % SERVER_MAX_CONNECTIONS] = fd;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return pushed;
+}
+
+static int server_queue_pop(server_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    int fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % SERVER_MAX_CONNECTIONS;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return fd;
+}
+
+static void server_return_conn(server_returns_t* returns, int fd, bool keep) {
+    pthread_mutex_lock(&returns->lock);
+    if (keep) returns->fds[returns->count++] = fd;
+    else      returns->closed++;
+    pthread_mutex_unlock(&returns->lock);
+    if (!keep) close(fd);
+    // a full pipe already guarantees a wakeup
+    ssize_t n = write(returns->wake[1], "", 1);
+    (void)n;
+}
+
+static uint64_t server_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void server_record_latency(uint64_t latency_us, bool ok) {
+    pthread_mutex_lock(&server_stats.lock);
+    server_stats.samples[server_stats.requests % SERVER_LATENCY_SAMPLES] = latency_us;
+    server_stats.requests++;
+    if (!ok) server_stats.errors++;
+    pthread_mutex_unlock(&server_stats.lock);
+}
+
+static int server_cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static size_t server_format_stats(char* out, size_t out_size) {
+    uint64_t samples[SERVER_LATENCY_SAMPLES];
+    pthread_mutex_lock(&server_stats.lock);
+    uint64_t requests = server_stats.requests;
+    uint64_t errors = server_stats.errors;
+    size_t count = requests < SERVER_LATENCY_SAMPLES ? requests : SERVER_LATENCY_SAMPLES;
+    memcpy(samples, server_stats.samples, count * sizeof(uint64_t));
+    pthread_mutex_unlock(&server_stats.lock);
+
+    if (count == 0)
+        return snprintf(out, out_size, "requests: 0\n");
+    qsort(samples, count, sizeof(uint64_t), server_cmp_u64);
+    int n = snprintf(out, out_size,
+        "requests: %lu\nerrors:   %lu\np50: %lu us\np90: %lu us\np99: %lu us\nmax: %lu us\n",
+        requests, errors,
+        samples[(count - 1) * 50 / 100],
+        samples[(count - 1) * 90 / 100],
+        samples[(count - 1) * 99 / 100],
+        samples[count - 1]);
+    return (size_t)n < out_size ? (size_t)n : out_size - 1;
+}
+
+static bool server_read_full(int fd, uint8_t* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool server_write_full(int fd, const uint8_t* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool server_recv_header(int conn, uint8_t* header, int* fds, uint32_t* fds_count) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = SERVER_HEADER_SIZE;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+
+    *fds_count = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* received = (int*)CMSG_DATA(cmsg);
+        for (size_t i = 0; i < count; i++) {
+            if (*fds_count < 2) fds[(*fds_count)++] = received[i];
+            else                close(received[i]);
+        }
+    }
+    return server_read_full(conn, header + n, SERVER_HEADER_SIZE - n);
+}
+
+static bool server_send_response(int conn, uint8_t status, const uint8_t* payload, size_t size, bool with_payload) {
+    uint8_t header[SERVER_HEADER_SIZE];
+    uint32_t length = htonl(size);
+    header[0] = status;
+    memcpy(header + 1, &length, sizeof(length));
+    if (!server_write_full(conn, header, sizeof(header))) return false;
+    if (with_payload && size > 0) return server_write_full(conn, payload, size);
+    return true;
+}
+
+static bool server_reserve(server_worker_t* worker, size_t size) {
+    if (size <= worker->buf_size) return true;
+    uint8_t* buf = realloc(worker->buf, size);
+    if (buf == NULL) return false;
+    worker->buf = buf;
+    worker->buf_size = size;
+    return true;
+}
+
+// Passed descriptors must be regular files: a pipe or socket the client never
+// feeds would block the worker with no timeout.
+static bool server_is_regular(int fd, struct stat* file_stat) {
+    return fstat(fd, file_stat) == 0 && S_ISREG(file_stat->st_mode);
+}
+
+static bool server_read_input_fd(server_worker_t* worker, int fd, size_t length, size_t* size) {
+    struct stat file_stat;
+    if (!server_is_regular(fd, &file_stat)) return false;
+    if (length == 0) length = file_stat.st_size;
+    if (length == 0 || length > SERVER_MAX_PAYLOAD) return false;
+    if (!server_reserve(worker, length)) return false;
+    *size = 0;
+    while (*size < length) {
+        ssize_t n = read(fd, worker->buf + *size, length - *size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) break;
+        *size += n;
+    }
+    return *size > 0;
+}
+
+static uint8_t* server_process(server_worker_t* worker, uint8_t op, size_t size, size_t* out_size) {
+    if (op == SERVER_OP_COMPRESS || op == SERVER_OP_COMPRESS_FD) {
+        huffman_cdata_t* cdata = huffman_compress_with_allocator(worker->buf, size, &worker->allocator);
+        *out_size = cdata->size;
+        return cdata->data;
+    }
+    // client data must never reach utils_fatal_error(), a bad stream is a failed request
+    uint64_t total = huffman_decompressed_size(worker->buf, size, &worker->allocator);
+    if (total == 0 || total > SERVER_MAX_PAYLOAD) return NULL;
+    return huffman_try_decompress(worker->buf, size, out_size, &worker->allocator);
+}
+
+static void server_set_response(server_response_t* response, uint8_t status, const uint8_t* payload, size_t size, bool with_payload) {
+    response->status = status;
+    response->payload = payload;
+    response->size = size;
+    response->with_payload = with_payload;
+}
+
+// Runs one request and fills in its response. Returns false when the
+// request failed; response->keep_alive says whether the stream is still in sync.
+static bool server_handle_request(server_worker_t* worker, int conn, uint8_t op, uint32_t length, int* fds, uint32_t fds_count, server_response_t* response) {
+    size_t size = 0;
+    size_t out_size = 0;
+    uint8_t* out = NULL;
+    bool fd_op = (op == SERVER_OP_COMPRESS_FD || op == SERVER_OP_DECOMPRESS_FD);
+    server_set_response(response, SERVER_STATUS_ERROR, NULL, 0, false);
+    response->keep_alive = true;
+
+    // consume the payload first so any op, even an unknown one, leaves the stream in sync
+    if (!fd_op && length > 0) {
+        if (length > SERVER_MAX_PAYLOAD || !server_reserve(worker, length) ||
+            !server_read_full(conn, worker->buf, length)) {
+            response->keep_alive = false;
+            return false;
+        }
+        size = length;
+    }
+
+    if (op == SERVER_OP_STATS) {
+        size_t text_size = server_format_stats(worker->text, sizeof(worker->text));
+        server_set_response(response, SERVER_STATUS_OK, (uint8_t*)worker->text, text_size, true);
+        return true;
+    }
+    if (op < SERVER_OP_COMPRESS || op > SERVER_OP_DECOMPRESS_FD) return false;
+    if (fd_op) {
+        struct stat file_stat;
+        if (fds_count != 2 || !server_is_regular(fds[1], &file_stat) ||
+            !server_read_input_fd(worker, fds[0], length, &size)) return false;
+    }
+    else if (size == 0) {
+        return false;
+    }
+
+    out = server_process(worker, op, size, &out_size);
+    // the reply length field is 32 bits
+    if (out == NULL || out_size > UINT32_MAX) return false;
+    if (fd_op) {
+        if (!server_write_full(fds[1], out, out_size)) return false;
+        server_set_response(response, SERVER_STATUS_OK, NULL, out_size, false);
+    }
+    else {
+        server_set_response(response, SERVER_STATUS_OK, out, out_size, true);
+    }
+    return true;
+}
+
+// Serves the one request the poll loop saw arriving. Returns false when the
+// connection should be closed.
+static bool server_serve_request(server_worker_t* worker, int conn) {
+    uint8_t header[SERVER_HEADER_SIZE];
+    int fds[2];
+    uint32_t fds_count = 0;
+    server_response_t response;
+    if (!server_recv_header(conn, header, fds, &fds_count)) {
+        for (uint32_t i = 0; i < fds_count; i++) close(fds[i]);
+        return false;
+    }
+    uint64_t start = server_now_us();
+    uint32_t length;
+    memcpy(&length, header + 1, sizeof(length));
+    bool ok = server_handle_request(worker, conn, header[0], ntohl(length), fds, fds_count, &response);
+    for (uint32_t i = 0; i < fds_count; i++) close(fds[i]);
+    // recorded before replying so a stats request sent after the reply sees it
+    if (header[0] != SERVER_OP_STATS)
+        server_record_latency(server_now_us() - start, ok);
+    bool sent = server_send_response(conn, response.status, response.payload, response.size, response.with_payload);
+    // one huge request must not pin its memory for the life of the worker
+    huffman_arena_trim(worker->arena, SERVER_KEEP_SIZE);
+    if (worker->buf_size > SERVER_KEEP_SIZE) {
+        free(worker->buf);
+        worker->buf = NULL;
+        worker->buf_size = 0;
+    }
+    return sent && response.keep_alive;
+}
+
+static void* server_worker_main(void* arg) {
+    server_worker_t worker;
+    worker.buf = NULL;
+    worker.buf_size = 0;
+    worker.arena = huffman_arena_create(SERVER_ARENA_CHUNK);
+    worker.allocator = huffman_arena_allocator(worker.arena);
+    (void)arg;
+    for (;;) {
+        int conn = server_queue_pop(&server_queue);
+        server_return_conn(&server_returns, conn, server_serve_request(&worker, conn));
+    }
+    return NULL;
+}
+
+static void server_on_signal(int signum) {
+    (void)signum;
+    server_stop = 1;
+}
+
+static void server_install_signals() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static int server_listen(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        utils_fatal_error("server_listen() failed - socket path too long");
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) utils_fatal_error("server_listen() failed - socket");
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        utils_fatal_error("server_listen() failed - bind");
+    if (listen(fd, SOMAXCONN) == -1)
+        utils_fatal_error("server_listen() failed - listen");
+    return fd;
+}
+
+typedef struct {
+    struct pollfd pfds[SERVER_MAX_CONNECTIONS + 2];
+    uint64_t last_active[SERVER_MAX_CONNECTIONS + 2];
+    uint32_t count;
+    uint32_t in_flight;
+} server_poll_t;
+
+static void server_poll_add(server_poll_t* poll_set, int fd, uint64_t now) {
+    poll_set->pfds[poll_set->count].fd = fd;
+    poll_set->pfds[poll_set->count].events = POLLIN;
+    poll_set->pfds[poll_set->count].revents = 0;
+    poll_set->last_active[poll_set->count] = now;
+    poll_set->count++;
+}
+
+static void server_poll_remove(server_poll_t* poll_set, uint32_t index) {
+    poll_set->count--;
+    poll_set->pfds[index] = poll_set->pfds[poll_set->count];
+    poll_set->last_active[index] = poll_set->last_active[poll_set->count];
+}
+
+// Idle connections stay here, only those with a request waiting go to the workers.
+static void server_dispatch_ready(server_poll_t* poll_set, uint64_t now) {
+    for (uint32_t i = poll_set->count; i-- > 2;) {
+        struct pollfd* pfd = &poll_set->pfds[i];
+        if (pfd->revents != 0) {
+            int fd = pfd->fd;
+            server_poll_remove(poll_set, i);
+            if (server_queue_push(&server_queue, fd)) poll_set->in_flight++;
+            else                                      close(fd);
+        }
+        else if (now - poll_set->last_active[i] > SERVER_IDLE_TIMEOUT_MS * 1000ull) {
+            close(pfd->fd);
+            server_poll_remove(poll_set, i);
+        }
+    }
+}
+
+static void server_collect_returns(server_poll_t* poll_set, uint64_t now) {
+    char drain[64];
+    while (read(server_returns.wake[0], drain, sizeof(drain)) > 0);
+    pthread_mutex_lock(&server_returns.lock);
+    for (uint32_t i = 0; i < server_returns.count; i++)
+        server_poll_add(poll_set, server_returns.fds[i], now);
+    poll_set->in_flight -= server_returns.count + server_returns.closed;
+    server_returns.count = 0;
+    server_returns.closed = 0;
+    pthread_mutex_unlock(&server_returns.lock);
+}
+
+static void server_accept_all(server_poll_t* poll_set, int listen_fd, uint64_t now) {
+    struct timeval timeout = { SERVER_IO_TIMEOUT_S, 0 };
+    for (;;) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0) return;
+        if (poll_set->count - 2 + poll_set->in_flight >= SERVER_MAX_CONNECTIONS) {
+            close(conn);
+            continue;
+        }
+        // a stalled client can hold a worker for at most this long per read or write
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        server_poll_add(poll_set, conn, now);
+    }
+}
+
+void server_run(const char* socket_path, uint32_t workers) {
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+    huffman_set_verbose(false);
+    server_install_signals();
+
+    memset(&server_queue, 0, sizeof(server_queue));
+    pthread_mutex_init(&server_queue.lock, NULL);
+    pthread_cond_init(&server_queue.not_empty, NULL);
+    memset(&server_returns, 0, sizeof(server_returns));
+    pthread_mutex_init(&server_returns.lock, NULL);
+    if (pipe(server_returns.wake) == -1)
+        utils_fatal_error("server_run() failed - pipe");
+    for (int i = 0; i < 2; i++)
+        fcntl(server_returns.wake[i], F_SETFL, O_NONBLOCK);
+    memset(&server_stats, 0, sizeof(server_stats));
+    pthread_mutex_init(&server_stats.lock, NULL);
+
+    int listen_fd = server_listen(socket_path);
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (uint32_t i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker_main, NULL) != 0)
+            utils_fatal_error("server_run() failed - pthread_create");
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    printf("Serving on %s with %u workers\n", socket_path, workers);
+    fflush(stdout);
+
+    static server_poll_t poll_set;
+    poll_set.count = 0;
+    poll_set.in_flight = 0;
+    server_poll_add(&poll_set, listen_fd, 0);
+    server_poll_add(&poll_set, server_returns.wake[0], 0);
+    while (!server_stop) {
+        if (poll(poll_set.pfds, poll_set.count, SERVER_POLL_INTERVAL_MS) < 0) continue;
+        uint64_t now = server_now_us();
+        bool wake = poll_set.pfds[1].revents != 0;
+        bool incoming = poll_set.pfds[0].revents != 0;
+        server_dispatch_ready(&poll_set, now);
+        if (wake) server_collect_returns(&poll_set, now);
+        if (incoming) server_accept_all(&poll_set, listen_fd, now);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    char text[256];
+    server_format_stats(text, sizeof(text));
+    printf("\n%s", text);
+}
@@ -0,0 +1,28 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol, all integers big-endian:
+ *   request:  op (1 byte) | length (4 bytes) | payload (length bytes)
+ *   response: status (1 byte) | length (4 bytes) | payload (length bytes)
+ *
+ * The *_FD ops carry no payload. The client passes two regular file
+ * descriptors (input, output) with SCM_RIGHTS alongside the request header and
+ * length is the number of bytes to read from input (0 = whole file).
+ * The result is written to the output descriptor and the response
+ * only carries its length.
+ */
+#define SERVER_OP_COMPRESS        1
+#define SERVER_OP_DECOMPRESS      2
+#define SERVER_OP_COMPRESS_FD     3
+#define SERVER_OP_DECOMPRESS_FD   4
+#define SERVER_OP_STATS           5
+
+#define SERVER_STATUS_OK          0
+#define SERVER_STATUS_ERROR       1
+
+void server_run(const char* socket_path, uint32_t workers);
+
+#endif